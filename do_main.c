@@ -6,11 +6,15 @@
 
 /* constants */
 #define DO_MAX_TODOS 1000
+#define DO_INDEX_SIZE 2048 /* power of two, at least twice DO_MAX_TODOS */
 #define DO_MAX_NAME_LEN 64
 #define DO_MAX_TITLE_LEN 256
 #ifndef DO_DB_FILE
 #define DO_DB_FILE "do_todos.db"
 #endif
+#define DO_BUSY_TIMEOUT_MS 5000
+#define DO_SCHEMA_VERSION 2 /* stored in PRAGMA user_version */
+#define DO_TOMBSTONE_RETENTION 1000 /* generations a tombstone is kept after its delete */
 
 /* ANSI color codes for prettier CLI */
 #define DO_COLOR_RESET "\x1b[0m"
@@ -26,22 +30,60 @@ typedef struct {
     char owner_name[DO_MAX_NAME_LEN];
     char title[DO_MAX_TITLE_LEN];
     int completed;
+    int dirty; /* changed locally since the last successful save */
 } do_todo;
 
 /* global storage */
 static do_todo do_todos[DO_MAX_TODOS];
 static int do_todo_count = 0;
+
+/* open-addressing id -> slot index over do_todos; id 0 marks an empty bucket */
+static int do_index_ids[DO_INDEX_SIZE];
+static int do_index_slots[DO_INDEX_SIZE];
 static char do_current_user[DO_MAX_NAME_LEN] = "";
-static int do_next_id = 1;
+
+/* ids deleted locally that still need a tombstone written on save */
+static int do_deleted_ids[DO_MAX_TODOS];
+static int do_deleted_count = 0;
+
+/* session connection and change-feed position */
+static sqlite3 *do_db = NULL;
+static int do_loaded = 0; /* set once do_load_data() has filled the store */
+static sqlite3_int64 do_last_generation = 0;
+static int do_data_version = 0;
+static int do_sync_skipped = 0; /* remote rows the last sync had no room for */
 
 /* function declarations (do_* style) */
+int do_db_has_column(const char *column);
+int do_read_data_version(int *version);
+int do_read_schema_version(int *version);
+int do_migrate_schema(void);
+int do_read_purge_watermark(sqlite3_int64 *watermark);
+int do_purge_tombstones(sqlite3_int64 generation);
+int do_open_db(void);
+void do_close_db(void);
+void do_copy_todo_columns(do_todo *t, sqlite3_stmt *stmt);
+int do_abort_load(void);
 int do_load_data(void);
+int do_is_pending_delete(int id);
+int do_has_pending_changes(void);
+int do_reload_data(void);
+int do_sync_data(void);
+int do_write_changes(sqlite3_int64 generation, int *new_slots, int *new_count);
 int do_save_data(void);
 void do_login(void);
 void do_show_menu(void);
 void do_list_todos(void);
 void do_create_todo(void);
 int do_find_todo_index_by_id(int id, const char *owner_name);
+int do_find_todo_index_any_owner(int id);
+unsigned do_index_bucket(int id);
+void do_index_put(int id, int slot);
+void do_index_remove(int id);
+void do_index_rebuild(void);
+void do_erase_todo_at(int index);
+int do_queue_tombstone(int id);
+int do_remove_todo_at(int index);
 void do_update_todo(void);
 void do_toggle_complete(void);
 void do_delete_todo(void);
@@ -93,51 +135,280 @@ int do_string_contains_case_insensitive(const char *haystack, const char *needle
     return 0;
 }
 
-int do_load_data(void) {
-    sqlite3 *db = NULL;
+int do_db_has_column(const char *column) {
+    sqlite3_stmt *stmt = NULL;
+    int found = 0;
+
+    if (sqlite3_prepare_v2(do_db, "PRAGMA table_info(todos);", -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *name = sqlite3_column_text(stmt, 1);
+        if (name != NULL && strcmp((const char *)name, column) == 0) {
+            found = 1;
+            break;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+int do_read_data_version(int *version) {
     sqlite3_stmt *stmt = NULL;
     int rc;
 
-    do_todo_count = 0;
-    do_next_id = 1;
+    rc = sqlite3_prepare_v2(do_db, "PRAGMA data_version;", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to read data version: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        return -1;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to read data version: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_finalize(stmt);
+        return -1;
+    }
+
+    *version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+int do_read_schema_version(int *version) {
+    sqlite3_stmt *stmt = NULL;
+    int rc;
+
+    rc = sqlite3_prepare_v2(do_db, "PRAGMA user_version;", -1, &stmt, NULL);
+    if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to read schema version: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_finalize(stmt);
+        return -1;
+    }
 
-    rc = sqlite3_open(DO_DB_FILE, &db);
+    *version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+/*
+ * Brings the schema up to DO_SCHEMA_VERSION. Runs under the write lock and
+ * re-checks the version once it is held, so concurrent sessions migrate once.
+ */
+int do_migrate_schema(void) {
+    int version;
+    int rc;
+
+    rc = sqlite3_exec(do_db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, DO_COLOR_RED "Error: cannot open database file '%s': %s\n" DO_COLOR_RESET,
-                DO_DB_FILE, sqlite3_errmsg(db));
-        if (db != NULL) {
-            sqlite3_close(db);
-        }
+        fprintf(stderr, DO_COLOR_RED "Error: failed to begin transaction: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
         return -1;
     }
 
+    if (do_read_schema_version(&version) != 0) {
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+    if (version >= DO_SCHEMA_VERSION) {
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return 0;
+    }
+
+    /*
+     * updated_at is the generation of the last write. Deleted rows stay as
+     * tombstones so other sessions can see the delete, until
+     * do_purge_tombstones() drops them.
+     */
     const char *create_sql =
         "CREATE TABLE IF NOT EXISTS todos ("
         "id INTEGER PRIMARY KEY, "
         "owner TEXT NOT NULL, "
         "title TEXT NOT NULL, "
-        "completed INTEGER NOT NULL"
+        "completed INTEGER NOT NULL, "
+        "updated_at INTEGER NOT NULL DEFAULT 0, "
+        "deleted INTEGER NOT NULL DEFAULT 0"
         ");";
 
-    rc = sqlite3_exec(db, create_sql, NULL, NULL, NULL);
+    rc = sqlite3_exec(do_db, create_sql, NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
         fprintf(stderr, DO_COLOR_RED "Error: failed to create todos table: %s\n" DO_COLOR_RESET,
-                sqlite3_errmsg(db));
-        sqlite3_close(db);
+                sqlite3_errmsg(do_db));
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    /* databases written before the change feed lack the new columns */
+    const char *migrations[][2] = {
+        {"updated_at", "ALTER TABLE todos ADD COLUMN updated_at INTEGER NOT NULL DEFAULT 0;"},
+        {"deleted", "ALTER TABLE todos ADD COLUMN deleted INTEGER NOT NULL DEFAULT 0;"},
+    };
+
+    for (size_t i = 0; i < sizeof(migrations) / sizeof(migrations[0]); i++) {
+        int has_column = do_db_has_column(migrations[i][0]);
+        if (has_column == 0) {
+            rc = sqlite3_exec(do_db, migrations[i][1], NULL, NULL, NULL);
+        }
+        if (has_column < 0 || rc != SQLITE_OK) {
+            fprintf(stderr, DO_COLOR_RED "Error: failed to add column '%s': %s\n" DO_COLOR_RESET,
+                    migrations[i][0], sqlite3_errmsg(do_db));
+            sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+            return -1;
+        }
+    }
+
+    const char *schema_sql =
+        "CREATE INDEX IF NOT EXISTS todos_updated_at ON todos (updated_at);"
+        "CREATE INDEX IF NOT EXISTS todos_tombstones ON todos (updated_at) WHERE deleted = 1;"
+        "CREATE TABLE IF NOT EXISTS todo_meta ("
+        "key TEXT PRIMARY KEY, "
+        "value INTEGER NOT NULL"
+        ");";
+
+    rc = sqlite3_exec(do_db, schema_sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to create indexes: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    char version_sql[64];
+    snprintf(version_sql, sizeof(version_sql), "PRAGMA user_version = %d;", DO_SCHEMA_VERSION);
+
+    rc = sqlite3_exec(do_db, version_sql, NULL, NULL, NULL);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(do_db, "COMMIT;", NULL, NULL, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to commit schema migration: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Opens the session connection once and keeps it for the whole run.
+ * PRAGMA data_version only reports commits made by *other* connections,
+ * so the staleness check in do_sync_data() needs a long-lived handle.
+ */
+int do_open_db(void) {
+    int version;
+    int rc;
+
+    if (do_db != NULL) {
+        return 0;
+    }
+
+    rc = sqlite3_open(DO_DB_FILE, &do_db);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: cannot open database file '%s': %s\n" DO_COLOR_RESET,
+                DO_DB_FILE, sqlite3_errmsg(do_db));
+        do_close_db();
+        return -1;
+    }
+
+    /* wait for other sessions' locks instead of failing with SQLITE_BUSY */
+    sqlite3_busy_timeout(do_db, DO_BUSY_TIMEOUT_MS);
+
+    /* best effort: WAL lets readers and a writer proceed concurrently */
+    sqlite3_exec(do_db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
+
+    /* plain read first; only an outdated schema needs the write lock */
+    if (do_read_schema_version(&version) != 0 ||
+        (version < DO_SCHEMA_VERSION && do_migrate_schema() != 0)) {
+        do_close_db();
+        return -1;
+    }
+
+    return 0;
+}
+
+void do_close_db(void) {
+    if (do_db != NULL) {
+        sqlite3_close(do_db);
+        do_db = NULL;
+    }
+}
+
+void do_copy_todo_columns(do_todo *t, sqlite3_stmt *stmt) {
+    const unsigned char *owner_text = sqlite3_column_text(stmt, 1);
+    const unsigned char *title_text = sqlite3_column_text(stmt, 2);
+    int completed_val = sqlite3_column_int(stmt, 3);
+
+    if (owner_text == NULL) {
+        owner_text = (const unsigned char *)"";
+    }
+    if (title_text == NULL) {
+        title_text = (const unsigned char *)"";
+    }
+
+    strncpy(t->owner_name, (const char *)owner_text, DO_MAX_NAME_LEN - 1);
+    t->owner_name[DO_MAX_NAME_LEN - 1] = '\0';
+
+    strncpy(t->title, (const char *)title_text, DO_MAX_TITLE_LEN - 1);
+    t->title[DO_MAX_TITLE_LEN - 1] = '\0';
+
+    t->completed = completed_val ? 1 : 0;
+}
+
+/*
+ * Drops a partial load and the connection so the next do_sync_data() falls
+ * back to a full reload instead of syncing from a bogus generation.
+ */
+int do_abort_load(void) {
+    sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+    do_todo_count = 0;
+    do_last_generation = 0;
+    do_index_rebuild();
+    do_close_db();
+    return -1;
+}
+
+int do_load_data(void) {
+    sqlite3_stmt *stmt = NULL;
+    int rc;
+
+    do_loaded = 0;
+    do_todo_count = 0;
+    do_deleted_count = 0;
+    do_last_generation = 0;
+
+    if (do_open_db() != 0) {
         return -1;
     }
 
+    /* one read transaction so the rows and the generation come from the same snapshot */
+    rc = sqlite3_exec(do_db, "BEGIN;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to begin transaction: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        return do_abort_load();
+    }
+
+    if (do_read_data_version(&do_data_version) != 0) {
+        return do_abort_load();
+    }
+
     const char *select_sql =
         "SELECT id, owner, title, completed "
         "FROM todos "
+        "WHERE deleted = 0 "
         "ORDER BY id;";
 
-    rc = sqlite3_prepare_v2(db, select_sql, -1, &stmt, NULL);
+    rc = sqlite3_prepare_v2(do_db, select_sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
         fprintf(stderr, DO_COLOR_RED "Error: failed to prepare select: %s\n" DO_COLOR_RESET,
-                sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return -1;
+                sqlite3_errmsg(do_db));
+        return do_abort_load();
     }
 
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
@@ -147,132 +418,456 @@ int do_load_data(void) {
 
         do_todo *t = &do_todos[do_todo_count];
         t->id = sqlite3_column_int(stmt, 0);
+        do_copy_todo_columns(t, stmt);
+        t->dirty = 0;
 
-        const unsigned char *owner_text = sqlite3_column_text(stmt, 1);
-        const unsigned char *title_text = sqlite3_column_text(stmt, 2);
-        int completed_val = sqlite3_column_int(stmt, 3);
+        do_todo_count++;
+    }
 
-        if (owner_text == NULL) {
-            owner_text = (const unsigned char *)"";
-        }
-        if (title_text == NULL) {
-            title_text = (const unsigned char *)"";
-        }
+    sqlite3_finalize(stmt);
 
-        strncpy(t->owner_name, (const char *)owner_text, DO_MAX_NAME_LEN - 1);
-        t->owner_name[DO_MAX_NAME_LEN - 1] = '\0';
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to read todos: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        return do_abort_load();
+    }
 
-        strncpy(t->title, (const char *)title_text, DO_MAX_TITLE_LEN - 1);
-        t->title[DO_MAX_TITLE_LEN - 1] = '\0';
+    rc = sqlite3_prepare_v2(do_db, "SELECT COALESCE(MAX(updated_at), 0) FROM todos;", -1, &stmt, NULL);
+    if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to read generation: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_finalize(stmt);
+        return do_abort_load();
+    }
+    do_last_generation = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
 
-        t->completed = completed_val ? 1 : 0;
+    rc = sqlite3_exec(do_db, "COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to commit transaction: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        return do_abort_load();
+    }
 
-        if (t->id >= do_next_id) {
-            do_next_id = t->id + 1;
-        }
+    do_index_rebuild();
+    do_loaded = 1;
+    return 0;
+}
 
-        do_todo_count++;
+/* highest generation whose tombstones may have been purged; 0 if none were */
+int do_read_purge_watermark(sqlite3_int64 *watermark) {
+    sqlite3_stmt *stmt = NULL;
+    int rc;
+
+    rc = sqlite3_prepare_v2(do_db, "SELECT value FROM todo_meta WHERE key = 'purged_through';",
+                            -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to read purge watermark: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        return -1;
     }
 
-    sqlite3_finalize(stmt);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to read purge watermark: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_finalize(stmt);
+        return -1;
+    }
 
+    *watermark = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
     return 0;
 }
 
-int do_save_data(void) {
-    sqlite3 *db = NULL;
+/*
+ * Drops tombstones more than DO_TOMBSTONE_RETENTION generations old so load
+ * time follows live rows, not delete history. Sessions that last synced
+ * below the recorded watermark may have missed those deletes and fall back
+ * to a full reload. Runs inside the save transaction.
+ */
+int do_purge_tombstones(sqlite3_int64 generation) {
     sqlite3_stmt *stmt = NULL;
+    sqlite3_int64 watermark = generation - DO_TOMBSTONE_RETENTION;
     int rc;
 
-    rc = sqlite3_open(DO_DB_FILE, &db);
+    if (watermark <= 0) {
+        return 0;
+    }
+
+    rc = sqlite3_prepare_v2(do_db, "DELETE FROM todos WHERE deleted = 1 AND updated_at <= ?1;",
+                            -1, &stmt, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, watermark);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    }
+    sqlite3_finalize(stmt);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, DO_COLOR_RED "Error: cannot open database file '%s': %s\n" DO_COLOR_RESET,
-                DO_DB_FILE, sqlite3_errmsg(db));
-        if (db != NULL) {
-            sqlite3_close(db);
-        }
+        fprintf(stderr, DO_COLOR_RED "Error: failed to purge tombstones: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
         return -1;
     }
 
-    const char *create_sql =
-        "CREATE TABLE IF NOT EXISTS todos ("
-        "id INTEGER PRIMARY KEY, "
-        "owner TEXT NOT NULL, "
-        "title TEXT NOT NULL, "
-        "completed INTEGER NOT NULL"
-        ");";
+    if (sqlite3_changes(do_db) == 0) {
+        return 0;
+    }
 
-    rc = sqlite3_exec(db, create_sql, NULL, NULL, NULL);
+    rc = sqlite3_prepare_v2(do_db,
+                            "INSERT OR REPLACE INTO todo_meta (key, value) VALUES ('purged_through', ?1);",
+                            -1, &stmt, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, watermark);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    }
+    sqlite3_finalize(stmt);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, DO_COLOR_RED "Error: failed to create todos table: %s\n" DO_COLOR_RESET,
-                sqlite3_errmsg(db));
-        sqlite3_close(db);
+        fprintf(stderr, DO_COLOR_RED "Error: failed to record purge watermark: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        return -1;
+    }
+
+    return 0;
+}
+
+int do_is_pending_delete(int id) {
+    for (int i = 0; i < do_deleted_count; i++) {
+        if (do_deleted_ids[i] == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int do_has_pending_changes(void) {
+    if (do_deleted_count > 0) {
+        return 1;
+    }
+    for (int i = 0; i < do_todo_count; i++) {
+        if (do_todos[i].dirty) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Full reload for when the change feed cannot be trusted. do_load_data()
+ * resets the store, so local edits are flushed first; if that save fails
+ * the reload is skipped and the edits stay queued.
+ */
+int do_reload_data(void) {
+    if (do_has_pending_changes() && do_save_data() != 0) {
         return -1;
     }
+    return do_load_data();
+}
+
+/*
+ * Pulls rows written by other sessions since the last seen generation and
+ * patches do_todos in place. When no other connection has committed, this
+ * costs a single PRAGMA; otherwise it reads only the changed rows through
+ * the updated_at index and applies each one in O(1) via the id index.
+ * Local unsaved edits win over remote updates, remote deletions always apply.
+ */
+int do_sync_data(void) {
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_int64 watermark;
+    int data_version;
+    int rc;
+
+    do_sync_skipped = 0;
+
+    if (!do_loaded) {
+        return do_reload_data();
+    }
 
-    rc = sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+    if (do_read_data_version(&data_version) != 0) {
+        return -1;
+    }
+    if (data_version == do_data_version) {
+        return 0;
+    }
+
+    /* one read transaction so the purge watermark and the changes agree */
+    rc = sqlite3_exec(do_db, "BEGIN;", NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
         fprintf(stderr, DO_COLOR_RED "Error: failed to begin transaction: %s\n" DO_COLOR_RESET,
-                sqlite3_errmsg(db));
-        sqlite3_close(db);
+                sqlite3_errmsg(do_db));
         return -1;
     }
 
-    rc = sqlite3_exec(db, "DELETE FROM todos;", NULL, NULL, NULL);
+    if (do_read_purge_watermark(&watermark) != 0) {
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+    if (do_last_generation < watermark) {
+        /* deletes we never saw may be purged already; only a full reload is safe */
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return do_reload_data();
+    }
+
+    const char *changes_sql =
+        "SELECT id, owner, title, completed, deleted, updated_at "
+        "FROM todos "
+        "WHERE updated_at > ?1 "
+        "ORDER BY updated_at, id;";
+
+    rc = sqlite3_prepare_v2(do_db, changes_sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, DO_COLOR_RED "Error: failed to clear todos table: %s\n" DO_COLOR_RESET,
-                sqlite3_errmsg(db));
-        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-        sqlite3_close(db);
+        fprintf(stderr, DO_COLOR_RED "Error: failed to prepare change query: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
         return -1;
     }
+    sqlite3_bind_int64(stmt, 1, do_last_generation);
 
-    const char *insert_sql =
-        "INSERT INTO todos (id, owner, title, completed) "
-        "VALUES (?1, ?2, ?3, ?4);";
+    sqlite3_int64 max_generation = do_last_generation;
+    sqlite3_int64 first_skipped = 0; /* generation of the first row the store had no room for */
+    int skipped_count = 0;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int id = sqlite3_column_int(stmt, 0);
+        int deleted = sqlite3_column_int(stmt, 4);
+        sqlite3_int64 generation = sqlite3_column_int64(stmt, 5);
+
+        if (generation > max_generation) {
+            max_generation = generation;
+        }
+
+        int index = do_find_todo_index_any_owner(id);
+
+        if (deleted) {
+            if (index >= 0) {
+                do_erase_todo_at(index);
+            }
+            continue;
+        }
+
+        if (index >= 0 && do_todos[index].dirty) {
+            continue;
+        }
 
-    rc = sqlite3_prepare_v2(db, insert_sql, -1, &stmt, NULL);
+        if (index < 0) {
+            if (do_is_pending_delete(id)) {
+                continue;
+            }
+            if (do_todo_count >= DO_MAX_TODOS) {
+                if (skipped_count++ == 0) {
+                    first_skipped = generation;
+                }
+                continue;
+            }
+            index = do_todo_count++;
+            do_todos[index].id = id;
+            do_todos[index].dirty = 0;
+            do_index_put(id, index);
+        }
+
+        do_copy_todo_columns(&do_todos[index], stmt);
+    }
+
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to read changes: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_finalize(stmt);
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    sqlite3_finalize(stmt);
+
+    rc = sqlite3_exec(do_db, "COMMIT;", NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, DO_COLOR_RED "Error: failed to prepare insert: %s\n" DO_COLOR_RESET,
-                sqlite3_errmsg(db));
-        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-        sqlite3_close(db);
+        fprintf(stderr, DO_COLOR_RED "Error: failed to commit transaction: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    /*
+     * Re-read from just before the first skipped row next time; rows past it
+     * that were already applied patch idempotently. Leaving data_version
+     * stale forces that retry even if nobody else commits.
+     */
+    if (skipped_count > 0) {
+        do_sync_skipped = skipped_count;
+        do_last_generation = first_skipped - 1;
         return -1;
     }
+
+    do_last_generation = max_generation;
+    do_data_version = data_version;
+    return 0;
+}
+
+/*
+ * Writes the dirty rows and pending tombstones stamped with `generation`.
+ * Slots of newly inserted todos are recorded in new_slots so the caller can
+ * undo their id assignment if the transaction is rolled back.
+ */
+int do_write_changes(sqlite3_int64 generation, int *new_slots, int *new_count) {
+    sqlite3_stmt *stmt = NULL;
+    int rc;
+
+    const char *delete_sql =
+        "UPDATE todos SET deleted = 1, updated_at = ?1 "
+        "WHERE id = ?2 AND deleted = 0;";
+
+    rc = sqlite3_prepare_v2(do_db, delete_sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to prepare delete: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        return -1;
+    }
+    for (int i = 0; i < do_deleted_count; i++) {
+        sqlite3_bind_int64(stmt, 1, generation);
+        sqlite3_bind_int(stmt, 2, do_deleted_ids[i]);
+
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, DO_COLOR_RED "Error: failed to delete todo: %s\n" DO_COLOR_RESET,
+                    sqlite3_errmsg(do_db));
+            sqlite3_finalize(stmt);
+            return -1;
+        }
+
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    /* a row deleted by another session stays deleted; the local edit is dropped */
+    const char *update_sql =
+        "UPDATE todos SET owner = ?2, title = ?3, completed = ?4, updated_at = ?5 "
+        "WHERE id = ?1 AND deleted = 0;";
+    const char *insert_sql =
+        "INSERT INTO todos (owner, title, completed, updated_at) "
+        "VALUES (?2, ?3, ?4, ?5);";
+    sqlite3_stmt *update_stmt = NULL;
+    sqlite3_stmt *insert_stmt = NULL;
+
+    rc = sqlite3_prepare_v2(do_db, update_sql, -1, &update_stmt, NULL);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(do_db, insert_sql, -1, &insert_stmt, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to prepare write: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_finalize(update_stmt);
+        return -1;
+    }
+
     for (int i = 0; i < do_todo_count; i++) {
         do_todo *t = &do_todos[i];
+        if (!t->dirty) {
+            continue;
+        }
+
+        stmt = t->id == 0 ? insert_stmt : update_stmt;
 
-        sqlite3_bind_int(stmt, 1, t->id);
+        if (t->id != 0) {
+            sqlite3_bind_int(stmt, 1, t->id);
+        }
         sqlite3_bind_text(stmt, 2, t->owner_name, -1, SQLITE_TRANSIENT);
         sqlite3_bind_text(stmt, 3, t->title, -1, SQLITE_TRANSIENT);
         sqlite3_bind_int(stmt, 4, t->completed);
+        sqlite3_bind_int64(stmt, 5, generation);
 
         rc = sqlite3_step(stmt);
         if (rc != SQLITE_DONE) {
-            fprintf(stderr, DO_COLOR_RED "Error: failed to insert todo: %s\n" DO_COLOR_RESET,
-                    sqlite3_errmsg(db));
-            sqlite3_finalize(stmt);
-            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-            sqlite3_close(db);
+            fprintf(stderr, DO_COLOR_RED "Error: failed to write todo: %s\n" DO_COLOR_RESET,
+                    sqlite3_errmsg(do_db));
+            sqlite3_finalize(update_stmt);
+            sqlite3_finalize(insert_stmt);
             return -1;
         }
 
         sqlite3_reset(stmt);
         sqlite3_clear_bindings(stmt);
+
+        if (t->id == 0) {
+            t->id = (int)sqlite3_last_insert_rowid(do_db);
+            do_index_put(t->id, i);
+            new_slots[(*new_count)++] = i;
+        }
+    }
+
+    sqlite3_finalize(update_stmt);
+    sqlite3_finalize(insert_stmt);
+    return 0;
+}
+
+int do_save_data(void) {
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_int64 generation;
+    int new_slots[DO_MAX_TODOS];
+    int new_count = 0;
+    int data_version;
+    int rc;
+
+    if (!do_has_pending_changes()) {
+        return 0;
+    }
+
+    if (do_open_db() != 0) {
+        return -1;
     }
 
+    /* IMMEDIATE takes the write lock up front so the generation cannot race */
+    rc = sqlite3_exec(do_db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to begin transaction: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        return -1;
+    }
+
+    if (do_read_data_version(&data_version) != 0) {
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    rc = sqlite3_prepare_v2(do_db, "SELECT COALESCE(MAX(updated_at), 0) + 1 FROM todos;", -1, &stmt, NULL);
+    if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+        fprintf(stderr, DO_COLOR_RED "Error: failed to read generation: %s\n" DO_COLOR_RESET,
+                sqlite3_errmsg(do_db));
+        sqlite3_finalize(stmt);
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+    generation = sqlite3_column_int64(stmt, 0);
     sqlite3_finalize(stmt);
 
-    rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    rc = do_write_changes(generation, new_slots, &new_count);
+    if (rc == 0) {
+        rc = do_purge_tombstones(generation);
+    }
+    if (rc == 0) {
+        rc = sqlite3_exec(do_db, "COMMIT;", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, DO_COLOR_RED "Error: failed to commit transaction: %s\n" DO_COLOR_RESET,
+                    sqlite3_errmsg(do_db));
+        }
+    }
     if (rc != SQLITE_OK) {
-        fprintf(stderr, DO_COLOR_RED "Error: failed to commit transaction: %s\n" DO_COLOR_RESET,
-                sqlite3_errmsg(db));
-        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-        sqlite3_close(db);
+        sqlite3_exec(do_db, "ROLLBACK;", NULL, NULL, NULL);
+        for (int i = 0; i < new_count; i++) {
+            do_index_remove(do_todos[new_slots[i]].id);
+            do_todos[new_slots[i]].id = 0;
+        }
         return -1;
     }
 
-    sqlite3_close(db);
+    for (int i = 0; i < do_todo_count; i++) {
+        do_todos[i].dirty = 0;
+    }
+    do_deleted_count = 0;
+
+    /*
+     * Skip our own generation only if nobody else committed since the last
+     * sync; otherwise the next sync re-reads it along with their changes.
+     */
+    if (do_loaded && data_version == do_data_version) {
+        do_last_generation = generation;
+    }
+
     return 0;
 }
 
@@ -355,39 +950,151 @@ void do_create_todo(void) {
     }
 
     do_todo *t = &do_todos[do_todo_count];
-    t->id = do_next_id++;
+    t->id = 0; /* assigned by the database on save */
     strncpy(t->owner_name, do_current_user, DO_MAX_NAME_LEN - 1);
     t->owner_name[DO_MAX_NAME_LEN - 1] = '\0';
     strncpy(t->title, title, DO_MAX_TITLE_LEN - 1);
     t->title[DO_MAX_TITLE_LEN - 1] = '\0';
     t->completed = 0;
+    t->dirty = 1;
 
     do_todo_count++;
 
     do_todo *t2 = &do_todos[do_todo_count];
-    t2->id = do_next_id++;
+    t2->id = 0;
     strncpy(t2->owner_name, do_current_user, DO_MAX_NAME_LEN - 1);
     t2->owner_name[DO_MAX_NAME_LEN - 1] = '\0';
     strncpy(t2->title, title, DO_MAX_TITLE_LEN - 1);
     t2->title[DO_MAX_TITLE_LEN - 1] = '\0';
     t2->completed = 0;
+    t2->dirty = 1;
 
     do_todo_count++;
 
     if (do_save_data() == 0) {
         printf(DO_COLOR_GREEN "Todo created twice with IDs %d and %d.\n" DO_COLOR_RESET, t->id, t2->id);
     } else {
-        printf(DO_COLOR_RED "Todo created but failed to save.\n" DO_COLOR_RESET);
+        /* ids come from the database, so an unsaved todo cannot be addressed */
+        do_todo_count -= 2;
+        printf(DO_COLOR_RED "Todo not created: failed to save.\n" DO_COLOR_RESET);
     }
 }
 
-int do_find_todo_index_by_id(int id, const char *owner_name) {
+unsigned do_index_bucket(int id) {
+    return ((unsigned)id * 2654435761u) & (DO_INDEX_SIZE - 1);
+}
+
+void do_index_put(int id, int slot) {
+    unsigned b = do_index_bucket(id);
+    while (do_index_ids[b] != 0 && do_index_ids[b] != id) {
+        b = (b + 1) & (DO_INDEX_SIZE - 1);
+    }
+    do_index_ids[b] = id;
+    do_index_slots[b] = slot;
+}
+
+/* deletes one entry, shifting later probes back so lookups never hit a hole */
+void do_index_remove(int id) {
+    unsigned b = do_index_bucket(id);
+    while (do_index_ids[b] != 0 && do_index_ids[b] != id) {
+        b = (b + 1) & (DO_INDEX_SIZE - 1);
+    }
+    if (do_index_ids[b] == 0) {
+        return;
+    }
+
+    unsigned hole = b;
+    unsigned next = (b + 1) & (DO_INDEX_SIZE - 1);
+    while (do_index_ids[next] != 0) {
+        unsigned home = do_index_bucket(do_index_ids[next]);
+        /* an entry may fill the hole only if its home bucket is not between hole and next */
+        if (((next - home) & (DO_INDEX_SIZE - 1)) >= ((next - hole) & (DO_INDEX_SIZE - 1))) {
+            do_index_ids[hole] = do_index_ids[next];
+            do_index_slots[hole] = do_index_slots[next];
+            hole = next;
+        }
+        next = (next + 1) & (DO_INDEX_SIZE - 1);
+    }
+    do_index_ids[hole] = 0;
+}
+
+void do_index_rebuild(void) {
+    memset(do_index_ids, 0, sizeof(do_index_ids));
     for (int i = 0; i < do_todo_count; i++) {
-        do_todo *t = &do_todos[i];
-        if (t->id == id && strcmp(t->owner_name, owner_name) == 0) {
-            return i;
+        if (do_todos[i].id > 0) {
+            do_index_put(do_todos[i].id, i);
         }
     }
+}
+
+int do_find_todo_index_any_owner(int id) {
+    if (id <= 0) {
+        return -1;
+    }
+
+    unsigned b = do_index_bucket(id);
+    while (do_index_ids[b] != 0) {
+        if (do_index_ids[b] == id) {
+            int slot = do_index_slots[b];
+            if (slot < do_todo_count && do_todos[slot].id == id) {
+                return slot;
+            }
+            return -1;
+        }
+        b = (b + 1) & (DO_INDEX_SIZE - 1);
+    }
+    return -1;
+}
+
+/* removes one slot by moving the last todo into it; list order is not kept */
+void do_erase_todo_at(int index) {
+    int last = do_todo_count - 1;
+
+    if (do_todos[index].id > 0) {
+        do_index_remove(do_todos[index].id);
+    }
+    if (index != last) {
+        do_todos[index] = do_todos[last];
+        if (do_todos[index].id > 0) {
+            do_index_put(do_todos[index].id, index);
+        }
+    }
+    do_todo_count--;
+}
+
+/*
+ * Queues a tombstone for the next save. A full queue means earlier saves
+ * failed; flush it with a save now rather than lose the delete.
+ */
+int do_queue_tombstone(int id) {
+    if (id <= 0) {
+        return 0;
+    }
+
+    if (do_deleted_count >= DO_MAX_TODOS && do_save_data() != 0) {
+        printf(DO_COLOR_RED "Too many unsaved deletes; todo %d was not deleted.\n" DO_COLOR_RESET, id);
+        return -1;
+    }
+
+    do_deleted_ids[do_deleted_count++] = id;
+    return 0;
+}
+
+/* removes a todo from the store and queues its tombstone for the next save */
+int do_remove_todo_at(int index) {
+    if (do_queue_tombstone(do_todos[index].id) != 0) {
+        return -1;
+    }
+
+    do_erase_todo_at(index);
+    return 0;
+}
+
+int do_find_todo_index_by_id(int id, const char *owner_name) {
+    int index = do_find_todo_index_any_owner(id);
+    if (index >= 0 && strcmp(do_todos[index].owner_name, owner_name) == 0) {
+        return index;
+    }
     return -1;
 }
 
@@ -437,6 +1144,7 @@ void do_update_todo(void) {
             t->completed = t->completed ? 0 : 1;
         }
     }
+    t->dirty = 1;
 
     if (do_save_data() == 0) {
         printf(DO_COLOR_GREEN "Todo updated.\n" DO_COLOR_RESET);
@@ -469,6 +1177,7 @@ void do_toggle_complete(void) {
 
     do_todo *t = &do_todos[index];
     t->completed = t->completed ? 0 : 1;
+    t->dirty = 1;
 
     if (do_save_data() == 0) {
         printf(DO_COLOR_GREEN "Todo status toggled.\n" DO_COLOR_RESET);
@@ -524,10 +1233,9 @@ void do_delete_todo(void) {
             return;
         }
 
-        for (int i = index; i < do_todo_count - 1; i++) {
-            do_todos[i] = do_todos[i + 1];
+        if (do_remove_todo_at(index) != 0) {
+            return;
         }
-        do_todo_count--;
 
         if (do_save_data() == 0) {
             printf(DO_COLOR_GREEN "Todo deleted.\n" DO_COLOR_RESET);
@@ -546,10 +1254,9 @@ void do_delete_todo(void) {
                     break;
                 }
                 if (buffer[0] == 'y' || buffer[0] == 'Y') {
-                    for (int j = i; j < do_todo_count - 1; j++) {
-                        do_todos[j] = do_todos[j + 1];
+                    if (do_remove_todo_at(i) != 0) {
+                        break;
                     }
-                    do_todo_count--;
                     removed++;
                     i--;
                 }
@@ -571,7 +1278,6 @@ void do_delete_todo(void) {
 }
 
 void do_clear_completed(void) {
-    int write_index = 0;
     int removed = 0;
     int first_completed_found = 0;
 
@@ -581,25 +1287,17 @@ void do_clear_completed(void) {
             if (!first_completed_found) {
                 // Keep the first completed item
                 first_completed_found = 1;
-                if (write_index != i) {
-                    do_todos[write_index] = do_todos[i];
-                }
-                write_index++;
             } else {
                 // Remove subsequent completed items
+                if (do_remove_todo_at(i) != 0) {
+                    break;
+                }
                 removed++;
-                continue;
-            }
-        } else {
-            if (write_index != i) {
-                do_todos[write_index] = do_todos[i];
+                i--;
             }
-            write_index++;
         }
     }
 
-    do_todo_count = write_index;
-
     if (removed == 0) {
         printf(DO_COLOR_YELLOW "No completed todos to clear.\n" DO_COLOR_RESET);
         return;
@@ -623,6 +1321,17 @@ void do_main_loop(void) {
         }
 
         int choice = atoi(buffer);
+
+        /* sync right before a todo command; cheap when nothing changed (one PRAGMA) */
+        if (choice >= 1 && choice <= 6 && do_sync_data() != 0) {
+            if (do_sync_skipped > 0) {
+                printf(DO_COLOR_RED "Warning: todo limit reached; %d todos from other sessions not loaded.\n"
+                       DO_COLOR_RESET, do_sync_skipped);
+            } else {
+                printf(DO_COLOR_RED "Warning: could not refresh from other sessions; showing local data.\n"
+                       DO_COLOR_RESET);
+            }
+        }
         switch (choice) {
             case 1:
                 do_list_todos();
@@ -662,6 +1371,7 @@ int do_main(void) {
     if (do_save_data() != 0) {
         printf(DO_COLOR_RED "Warning: could not save data on exit.\n" DO_COLOR_RESET);
     }
+    do_close_db();
 
     return 0;
 }